@@ -0,0 +1,365 @@
+#include <errno.h>
+#include <stdlib.h>
+
+#ifdef HAVE_THREADS
+#include <rthreads/rthreads.h>
+#endif
+
+#include "gfxprim_anim.h"
+#include "gfxprim_simd.h"
+
+/* Frame delay record, in milliseconds, filled in by animated image loaders. */
+#define ANIM_DELAY_KEY "Delay"
+/* Used for frames without a delay record, in microseconds. */
+#define ANIM_DEFAULT_DELAY 100000
+/* Playback lag is capped, so a stalled decoder doesn't cause endless drops. */
+#define ANIM_MAX_LAG 1000000
+
+struct anim_frame {
+	gp_pixmap *pixmap;
+	/* Display time in microseconds */
+	uint32_t delay;
+};
+
+struct gfxprim_anim {
+	gp_container *container;
+	gp_storage *storage;
+	/* Frames decoded since the last rewind */
+	unsigned int decoded;
+
+	unsigned int ring_size;
+	/* Next slot to decode into */
+	unsigned int head;
+	/* Next slot to present */
+	unsigned int tail;
+	/* Decoded frames waiting to be presented */
+	unsigned int count;
+	bool eof;
+	bool quit;
+
+	/* Time elapsed since the shown frame was due */
+	int64_t clock;
+	uint32_t shown_delay;
+	bool shown;
+	unsigned int dropped;
+
+#ifdef HAVE_THREADS
+	sthread_t *thread;
+	slock_t *lock;
+	scond_t *cond;
+#endif
+
+	struct anim_frame frames[];
+};
+
+static void anim_lock(gfxprim_anim *self) {
+#ifdef HAVE_THREADS
+	slock_lock(self->lock);
+#else
+	(void)self;
+#endif
+}
+
+static void anim_unlock(gfxprim_anim *self) {
+#ifdef HAVE_THREADS
+	slock_unlock(self->lock);
+#else
+	(void)self;
+#endif
+}
+
+static uint32_t frame_delay(gfxprim_anim *self) {
+	gp_data_node *node;
+
+	if (!self->storage)
+		return ANIM_DEFAULT_DELAY;
+
+	node = gp_storage_get(self->storage, NULL, ANIM_DELAY_KEY);
+	if (!node || node->type != GP_DATA_INT || node->value.i <= 0)
+		return ANIM_DEFAULT_DELAY;
+
+	return (uint32_t)node->value.i * 1000;
+}
+
+/* Converts a decoded image into the preallocated ring pixmap. */
+static void frame_set(struct anim_frame *frame, gp_pixmap *img, uint32_t delay) {
+	gp_pixmap *dst = frame->pixmap;
+
+	if (img->w < dst->w || img->h < dst->h)
+		gfxprim_fill(dst, 0);
+
+	gfxprim_blit_xywh_clipped(img, 0, 0, img->w, img->h, dst,
+	                          ((gp_coord)dst->w - (gp_coord)img->w) / 2,
+	                          ((gp_coord)dst->h - (gp_coord)img->h) / 2);
+
+	frame->delay = delay;
+}
+
+/*
+ * Loads past the last frame fail too, these errno values tell broken or
+ * unsupported data apart from the end of the animation.
+ */
+static bool load_error(int err) {
+	switch (err) {
+		case EIO:
+		case EINVAL:
+		case ENOMEM:
+		case ENOSYS:
+		case ECANCELED:
+			return true;
+		default:
+			return false;
+	}
+}
+
+/*
+ * Decodes the next frame into the slot, rewinding at the end of the
+ * animation. Returns false when there is nothing more to play or the
+ * data is broken.
+ */
+static bool decode_frame(gfxprim_anim *self, struct anim_frame *frame) {
+	gp_pixmap *img = NULL;
+	bool rewound = false;
+
+	for (;;) {
+		gp_storage_clear(self->storage);
+
+		errno = 0;
+		if (!gp_container_load_ex(self->container, &img, self->storage, NULL) && img)
+			break;
+
+		/* Stop on the last good frame rather than looping up to the broken one */
+		if (load_error(errno))
+			return false;
+
+		/* Single frame images have nothing to loop */
+		if (rewound || self->decoded < 2)
+			return false;
+
+		if (gp_container_seek(self->container, 0, GP_CONT_FIRST))
+			return false;
+
+		self->decoded = 0;
+		rewound = true;
+	}
+
+	/* Loaders allocate the frame, so it is converted into the slot and freed */
+	frame_set(frame, img, frame_delay(self));
+	gp_pixmap_free(img);
+	self->decoded++;
+
+	return true;
+}
+
+/* Decodes into the head slot, called without the lock held. */
+static void produce(gfxprim_anim *self) {
+	struct anim_frame *frame = &self->frames[self->head];
+	bool decoded = decode_frame(self, frame);
+
+	anim_lock(self);
+
+	if (decoded) {
+		self->head = (self->head + 1) % self->ring_size;
+		self->count++;
+	} else {
+		self->eof = true;
+	}
+
+	anim_unlock(self);
+}
+
+#ifdef HAVE_THREADS
+static void producer_thread(void *data) {
+	gfxprim_anim *self = data;
+
+	slock_lock(self->lock);
+
+	while (!self->quit) {
+		/* Backpressure, wait until the consumer frees a slot */
+		if (self->eof || self->count == self->ring_size) {
+			scond_wait(self->cond, self->lock);
+			continue;
+		}
+
+		slock_unlock(self->lock);
+		produce(self);
+		slock_lock(self->lock);
+	}
+
+	slock_unlock(self->lock);
+}
+#endif
+
+/* Hands the tail slot back to the producer, called with the lock held. */
+static void release_frame(gfxprim_anim *self) {
+	self->tail = (self->tail + 1) % self->ring_size;
+	self->count--;
+
+#ifdef HAVE_THREADS
+	scond_signal(self->cond);
+#endif
+}
+
+bool gfxprim_anim_update(gfxprim_anim *self, int64_t delta, gp_pixmap *pixmap) {
+	struct anim_frame *frame;
+
+	if (!self)
+		return false;
+
+#ifndef HAVE_THREADS
+	if (!self->eof && self->count < self->ring_size)
+		produce(self);
+#endif
+
+	anim_lock(self);
+
+	self->clock += delta;
+	if (self->clock > ANIM_MAX_LAG)
+		self->clock = ANIM_MAX_LAG;
+
+	if (self->shown && self->clock < self->shown_delay)
+		goto unlock;
+
+	/* Decoder is behind or the animation has ended, hold the shown frame */
+	if (!self->count)
+		goto unlock;
+
+	if (self->shown)
+		self->clock -= self->shown_delay;
+	else
+		self->clock = 0;
+
+	/* Skip frames that are already over when a later one is ready */
+	while (self->count > 1 && self->clock >= self->frames[self->tail].delay) {
+		self->clock -= self->frames[self->tail].delay;
+		self->dropped++;
+		release_frame(self);
+	}
+
+	frame = &self->frames[self->tail];
+	anim_unlock(self);
+
+	/* The slot stays owned by the consumer until it is released */
+	gfxprim_blit_xywh_clipped(frame->pixmap, 0, 0, frame->pixmap->w, frame->pixmap->h, pixmap, 0, 0);
+
+	anim_lock(self);
+	self->shown_delay = frame->delay;
+	self->shown = true;
+	release_frame(self);
+	anim_unlock(self);
+
+	return true;
+unlock:
+	anim_unlock(self);
+	return false;
+}
+
+unsigned int gfxprim_anim_dropped(gfxprim_anim *self) {
+	unsigned int dropped;
+
+	if (!self)
+		return 0;
+
+	anim_lock(self);
+	dropped = self->dropped;
+	anim_unlock(self);
+
+	return dropped;
+}
+
+gfxprim_anim *gfxprim_anim_open(const char *path, gp_size w, gp_size h,
+                                enum gp_pixel_type pixel_type, unsigned int ring_size) {
+	gfxprim_anim *self;
+	unsigned int i;
+
+	if (!path || !ring_size)
+		return NULL;
+
+	self = calloc(1, sizeof(*self) + ring_size * sizeof(struct anim_frame));
+	if (!self)
+		return NULL;
+
+	self->ring_size = ring_size;
+
+	for (i = 0; i < ring_size; i++) {
+		self->frames[i].pixmap = gp_pixmap_alloc(w, h, pixel_type);
+		if (!self->frames[i].pixmap)
+			goto err;
+	}
+
+#ifdef HAVE_THREADS
+	self->lock = slock_new();
+	self->cond = scond_new();
+	if (!self->lock || !self->cond)
+		goto err;
+#endif
+
+	self->container = gp_container_open(path);
+	if (!self->container) {
+		/* Not animated, play the image as a single frame */
+		gp_pixmap *img = gp_load_image(path, NULL);
+		if (!img)
+			goto err;
+
+		frame_set(&self->frames[0], img, ANIM_DEFAULT_DELAY);
+		gp_pixmap_free(img);
+		self->head = 1 % ring_size;
+		self->count = 1;
+		self->eof = true;
+		return self;
+	}
+
+	self->storage = gp_storage_create();
+	if (!self->storage)
+		goto err;
+
+	/* Decode the first frame up front, so broken files fail to open */
+	produce(self);
+	if (self->eof)
+		goto err;
+
+#ifdef HAVE_THREADS
+	self->thread = sthread_create(producer_thread, self);
+	if (!self->thread)
+		goto err;
+#endif
+
+	return self;
+err:
+	gfxprim_anim_close(self);
+	return NULL;
+}
+
+void gfxprim_anim_close(gfxprim_anim *self) {
+	unsigned int i;
+
+	if (!self)
+		return;
+
+#ifdef HAVE_THREADS
+	if (self->thread) {
+		slock_lock(self->lock);
+		self->quit = true;
+		scond_signal(self->cond);
+		slock_unlock(self->lock);
+		sthread_join(self->thread);
+	}
+
+	if (self->cond)
+		scond_free(self->cond);
+	if (self->lock)
+		slock_free(self->lock);
+#endif
+
+	if (self->container)
+		gp_container_close(self->container);
+	if (self->storage)
+		gp_storage_destroy(self->storage);
+
+	for (i = 0; i < self->ring_size; i++) {
+		if (self->frames[i].pixmap)
+			gp_pixmap_free(self->frames[i].pixmap);
+	}
+
+	free(self);
+}
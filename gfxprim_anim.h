@@ -0,0 +1,40 @@
+#ifndef GFXPRIM_ANIM_H_
+#define GFXPRIM_ANIM_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "gfxprim.h"
+
+/*
+ * Streaming playback of animated images.
+ *
+ * Frames are decoded ahead into a fixed ring of preallocated pixmaps, by a
+ * producer thread when built with HAVE_THREADS, or one frame per update
+ * otherwise. The decoder blocks while the ring is full and playback drops
+ * overdue frames when it falls behind, so memory stays bounded by the ring
+ * plus the one frame the image loader allocates while decoding, no matter
+ * how long the animation is. Animations loop, playback stops on the last
+ * good frame when the data turns out to be broken.
+ */
+typedef struct gfxprim_anim gfxprim_anim;
+
+/*
+ * Opens an animation, frames are centered into w x h pixmaps of pixel_type.
+ * Images that are not animated play as a single frame.
+ */
+gfxprim_anim *gfxprim_anim_open(const char *path, gp_size w, gp_size h,
+                                enum gp_pixel_type pixel_type, unsigned int ring_size);
+
+void gfxprim_anim_close(gfxprim_anim *self);
+
+/*
+ * Advances playback by delta microseconds. When a new frame is due it is
+ * blitted into pixmap and true is returned.
+ */
+bool gfxprim_anim_update(gfxprim_anim *self, int64_t delta, gp_pixmap *pixmap);
+
+/* Number of frames dropped so far because decoding fell behind. */
+unsigned int gfxprim_anim_dropped(gfxprim_anim *self);
+
+#endif  // GFXPRIM_ANIM_H_
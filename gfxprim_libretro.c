@@ -5,20 +5,56 @@
 #include "gfxprim.h"
 #include "libretro.h"
 #include "libretro-core-options.h"
+#include "gfxprim_anim.h"
+#include "gfxprim_simd.h"
+#include "gfxprim_text_cache.h"
 
 static struct retro_log_callback logging;
 static retro_log_printf_t log_cb;
 static retro_perf_get_time_usec_t perf_get_time_usec;
+static retro_get_cpu_features_t perf_get_cpu_features;
+
+/* Consecutive frames that may be skipped before one is forced out. */
+#define FRAMESKIP_MAX 3
+/* Clamp for frame deltas, so pauses don't jump animations ahead. */
+#define FRAME_DELTA_MAX 250000
+/* Lifetime of the click ripple animation in microseconds. */
+#define RIPPLE_DURATION 400000
+/* Decoded frames buffered ahead during animation playback. */
+#define ANIM_RING_SIZE 8
+
+/* Content is limited to the image loaders gfxprim was built with. */
+#if defined(HAVE_LIBGIF) && defined(HAVE_LIBWEBP)
+#define ANIM_EXTENSIONS "gif|webp"
+#elif defined(HAVE_LIBGIF)
+#define ANIM_EXTENSIONS "gif"
+#elif defined(HAVE_LIBWEBP)
+#define ANIM_EXTENSIONS "webp"
+#endif
 
 struct gfxprim_core {
 	gp_backend *backend;
 	gp_ev_queue ev_queue;
+	gfxprim_text_cache *textCache;
+	gfxprim_anim *anim;
 
 	int16_t mouseLeft, mouseRight;
 	int16_t mouseX, mouseY;
 	int16_t keyLeft, keyRight, keyUp, keyDown;
 	int16_t keyA, keyB, keySelect, keyStart;
 	enum gp_pixel_type pixelType;
+
+	unsigned frameRate;
+	double fps;
+	bool canDupe;
+	bool dirty;
+	retro_usec_t frameDelta;
+	retro_usec_t renderTime;
+	unsigned framesSkipped;
+
+	bool rippleActive;
+	int16_t rippleX, rippleY;
+	retro_usec_t rippleAge;
 };
 
 static struct gfxprim_core *core;
@@ -50,6 +86,54 @@ static void check_variables(void) {
 		if (strcmp(var.value, "32 Bit") == 0)
 			core->pixelType = GP_PIXEL_xRGB8888;
 	}
+
+	var.key = "gfxprim_framerate";
+	var.value = NULL;
+	core->frameRate = 60;
+	if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value) {
+		if (strcmp(var.value, "Native") == 0)
+			core->frameRate = 0;
+		else
+			core->frameRate = (unsigned)atoi(var.value);
+	}
+}
+
+static double get_target_fps(void) {
+	if (core->frameRate)
+		return core->frameRate;
+
+	float refresh = 0.0f;
+	if (environ_cb(RETRO_ENVIRONMENT_GET_TARGET_REFRESH_RATE, &refresh) && refresh > 0.0f)
+		return refresh;
+
+	return 60.0;
+}
+
+static retro_usec_t get_frame_budget(void) {
+	return (retro_usec_t)(1000000.0 / core->fps);
+}
+
+static void frame_time_cb(retro_usec_t usec) {
+	if (!core)
+		return;
+
+	if (usec > FRAME_DELTA_MAX)
+		usec = FRAME_DELTA_MAX;
+
+	core->frameDelta = usec;
+}
+
+static void set_frame_rate(double fps) {
+	core->fps = fps;
+	core->frameDelta = get_frame_budget();
+
+	struct retro_frame_time_callback frame_time = {
+		.callback  = frame_time_cb,
+		.reference = core->frameDelta,
+	};
+
+	if (!environ_cb(RETRO_ENVIRONMENT_SET_FRAME_TIME_CALLBACK, &frame_time))
+		log_cb(RETRO_LOG_WARN, "[GFXPrim]: Frame time callback not supported, assuming %.2f fps\n", fps);
 }
 
 static void retro_flip(gp_backend *self) {
@@ -66,6 +150,18 @@ static void retro_flip(gp_backend *self) {
 	}
 }
 
+static void retro_dupe(gp_backend *self) {
+	gp_pixmap *pixmap = self->pixmap;
+
+	if (!core->canDupe) {
+		/* The pixmap still holds the previous frame */
+		retro_flip(self);
+		return;
+	}
+
+	video_cb(NULL, pixmap->w, pixmap->h, pixmap->bytes_per_row);
+}
+
 static void retro_poll_mouse(gp_backend *self, uint64_t time) {
 	int16_t state = input_state_cb(0, RETRO_DEVICE_MOUSE, 0, RETRO_DEVICE_ID_MOUSE_LEFT);
 	if (state != core->mouseLeft) {
@@ -94,6 +190,8 @@ static void retro_poll_mouse(gp_backend *self, uint64_t time) {
 		else if (core->mouseY >= (int16_t)self->event_queue->screen_h)
 			core->mouseY = self->event_queue->screen_h - 1;
 		gp_ev_queue_set_cursor_pos(self->event_queue, core->mouseX, core->mouseY);
+		/* Setting the cursor position queues no event, redraw the cursor here */
+		core->dirty = true;
 	}
 }
 
@@ -174,6 +272,11 @@ void retro_init(void) {
 		return;
 
 	core->pixelType = GP_PIXEL_RGB565;
+	core->frameRate = 60;
+	core->fps = 60.0;
+
+	const char *simd = gfxprim_simd_init(perf_get_cpu_features ? perf_get_cpu_features() : 0);
+	log_cb(RETRO_LOG_INFO, "[GFXPrim]: Using %s fill and blit kernels\n", simd ? simd : "generic");
 }
 
 void retro_deinit(void) {
@@ -194,8 +297,13 @@ void retro_get_system_info(struct retro_system_info *info) {
 	info->library_name     = "gfxprim";
 	info->library_version  = "v0.0.1";
 	info->block_extract    = false;
+#ifdef ANIM_EXTENSIONS
+	info->need_fullpath    = true;
+	info->valid_extensions = ANIM_EXTENSIONS;
+#else
 	info->need_fullpath    = false;
 	info->valid_extensions = NULL;
+#endif
 }
 
 void retro_get_system_av_info(struct retro_system_av_info *info) {
@@ -203,7 +311,7 @@ void retro_get_system_av_info(struct retro_system_av_info *info) {
 		return;
 
 	info->timing = (struct retro_system_timing) {
-		.fps = 60.0,
+		.fps = core->fps,
 		.sample_rate = 0.0,
 	};
 
@@ -230,8 +338,10 @@ void retro_set_environment(retro_environment_t cb) {
 		log_cb = fallback_log;
 
 	struct retro_perf_callback perf;
-	if (cb(RETRO_ENVIRONMENT_GET_PERF_INTERFACE, &perf))
+	if (cb(RETRO_ENVIRONMENT_GET_PERF_INTERFACE, &perf)) {
 		perf_get_time_usec = perf.get_time_usec;
+		perf_get_cpu_features = perf.get_cpu_features;
+	}
 }
 
 void retro_set_audio_sample(retro_audio_sample_t cb) {
@@ -258,33 +368,74 @@ void retro_reset(void) {
 }
 
 static void render(gp_pixmap *pixmap) {
+	/* Animation frames are blitted straight into the pixmap */
+	if (core->anim)
+		return;
+
 	gp_pixel black  = gp_rgb_to_pixmap_pixel(10,  10,  10,  pixmap);
 	gp_pixel red    = gp_rgb_to_pixmap_pixel(230, 57,  70,  pixmap);
 	gp_pixel white  = gp_rgb_to_pixmap_pixel(245, 245, 245, pixmap);
 	gp_pixel blue   = gp_rgb_to_pixmap_pixel(69,  123, 157, pixmap);
 	gp_pixel orange = gp_rgb_to_pixmap_pixel(255, 161, 0,   pixmap);
 
-	gp_fill(pixmap, white);
+	gfxprim_fill(pixmap, white);
 
-	gp_fill_rect(pixmap, 100, 100, 20, 40, red);
-	gp_fill_circle(pixmap, 200, 150, 30, blue);
+	gfxprim_fill_rect(pixmap, 100, 100, 20, 40, red);
+	gfxprim_fill_circle(pixmap, 200, 150, 30, blue);
 	gp_line(pixmap, 250, 50, 230, 130, blue);
 	gp_fill_triangle(pixmap, 60, 200, 130, 180, 90, 150, orange);
 
-	gp_text(pixmap, NULL, pixmap->w / 2, 10, GP_ALIGN_CENTER | GP_VALIGN_BELOW, black, 0, "Hello World!");
+	gfxprim_text_cache_draw(core->textCache, pixmap, NULL, pixmap->w / 2, 10, GP_ALIGN_CENTER | GP_VALIGN_BELOW, black, white, "Hello World!");
 
-	gp_fill_circle(pixmap, core->mouseX, core->mouseY, 10, core->mouseLeft == 1 ? red : orange);
+	if (core->rippleActive) {
+		gp_size r = 10 + 30 * core->rippleAge / RIPPLE_DURATION;
+		gp_circle(pixmap, core->rippleX, core->rippleY, r, red);
+	}
+
+	gfxprim_fill_circle(pixmap, core->mouseX, core->mouseY, 10, core->mouseLeft == 1 ? red : orange);
+}
+
+static void animate(retro_usec_t delta) {
+	if (!core->rippleActive)
+		return;
+
+	core->rippleAge += delta;
+	if (core->rippleAge >= RIPPLE_DURATION)
+		core->rippleActive = false;
+
+	/* Redraw also once the ripple is gone to erase it */
+	core->dirty = true;
+}
+
+static bool frame_should_render(void) {
+	if (!core->dirty)
+		return false;
+
+	/* Never starve the screen, even if every frame overruns */
+	if (core->framesSkipped >= FRAMESKIP_MAX)
+		return true;
+
+	/*
+	 * Only this core's own drawing counts against the budget. A long frame
+	 * delta is the frontend's pacing, which skipping render() can't speed up.
+	 */
+	return core->renderTime <= get_frame_budget();
 }
 
 static void event_loop(gp_backend *backend) {
 	while (gp_backend_ev_queued(backend)) {
 		gp_event *ev = gp_backend_ev_get(backend);
+		core->dirty = true;
 		switch (ev->type) {
 			case GP_EV_KEY:
 				if (ev->code != GP_EV_KEY_DOWN)
 					break;
 				switch (ev->val) {
 					case GP_BTN_LEFT:
+						core->rippleActive = true;
+						core->rippleAge = 0;
+						core->rippleX = core->mouseX;
+						core->rippleY = core->mouseY;
 					break;
 				}
 			break;
@@ -298,19 +449,46 @@ void retro_run(void) {
 
 	gp_backend_poll(core->backend);
 	event_loop(core->backend);
-	render(core->backend->pixmap);
-	gp_backend_flip(core->backend);
+	animate(core->frameDelta);
+
+	if (gfxprim_anim_update(core->anim, core->frameDelta, core->backend->pixmap))
+		core->dirty = true;
+
+	if (frame_should_render()) {
+		retro_usec_t start = perf_get_time_usec ? perf_get_time_usec() : 0;
+
+		render(core->backend->pixmap);
+
+		/* Stop before the flip, presenting may block on vsync */
+		if (perf_get_time_usec)
+			core->renderTime = perf_get_time_usec() - start;
+
+		gp_backend_flip(core->backend);
+		core->framesSkipped = 0;
+		core->dirty = false;
+	} else {
+		retro_dupe(core->backend);
+		core->framesSkipped++;
+	}
 
 	audio_cb(0, 0);
 
 	bool updated = false;
-	if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE_UPDATE, &updated) && updated)
+	if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE_UPDATE, &updated) && updated) {
 		check_variables();
+
+		double fps = get_target_fps();
+		if (fps != core->fps) {
+			struct retro_system_av_info info;
+
+			set_frame_rate(fps);
+			retro_get_system_av_info(&info);
+			environ_cb(RETRO_ENVIRONMENT_SET_SYSTEM_AV_INFO, &info);
+		}
+	}
 }
 
 bool retro_load_game(const struct retro_game_info *info) {
-	(void)info;
-
 	if (!core)
 		return false;
 
@@ -337,18 +515,39 @@ bool retro_load_game(const struct retro_game_info *info) {
 
 	core->backend = backend;
 
+	/* Without a cache text is drawn with gp_text() directly */
+	core->textCache = gfxprim_text_cache_alloc(256, 128);
+	if (!core->textCache)
+		log_cb(RETRO_LOG_WARN, "[GFXPrim]: Failed to allocate text cache\n");
+
 	enum retro_pixel_format fmt = RETRO_PIXEL_FORMAT_RGB565;
 	if (core->backend->pixmap->pixel_type == GP_PIXEL_xRGB8888)
 		fmt = RETRO_PIXEL_FORMAT_XRGB8888;
 
 	if (!environ_cb(RETRO_ENVIRONMENT_SET_PIXEL_FORMAT, &fmt)) {
 		log_cb(RETRO_LOG_ERROR, "[GFXPrim]: Failed to set pixel format %i\n", fmt);
-		gp_pixmap_free(core->backend->pixmap);
-		free(core->backend);
-		core->backend = NULL;
+		retro_unload_game();
 		return false;
 	}
 
+	if (info && info->path) {
+		core->anim = gfxprim_anim_open(info->path, backend->pixmap->w, backend->pixmap->h,
+		                               backend->pixmap->pixel_type, ANIM_RING_SIZE);
+		if (!core->anim) {
+			log_cb(RETRO_LOG_ERROR, "[GFXPrim]: Failed to load %s\n", info->path);
+			retro_unload_game();
+			return false;
+		}
+	}
+
+	if (!environ_cb(RETRO_ENVIRONMENT_GET_CAN_DUPE, &core->canDupe))
+		core->canDupe = false;
+
+	set_frame_rate(get_target_fps());
+	core->framesSkipped = 0;
+	core->renderTime = 0;
+	core->dirty = true;
+
 	return true;
 }
 
@@ -356,6 +555,15 @@ void retro_unload_game(void) {
 	if (!core || !core->backend)
 		return;
 
+	if (core->anim) {
+		log_cb(RETRO_LOG_INFO, "[GFXPrim]: Dropped %u animation frames\n", gfxprim_anim_dropped(core->anim));
+		gfxprim_anim_close(core->anim);
+		core->anim = NULL;
+	}
+
+	gfxprim_text_cache_free(core->textCache);
+	core->textCache = NULL;
+
 	gp_pixmap_free(core->backend->pixmap);
 	free(core->backend);
 	core->backend = NULL;
@@ -0,0 +1,384 @@
+#include <stddef.h>
+#include <string.h>
+
+#include "libretro.h"
+#include "gfxprim_simd.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HAVE_SIMD_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_SIMD_AVX2 1
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define HAVE_SIMD_NEON 1
+#include <arm_neon.h>
+#endif
+
+struct span_kernels {
+	const char *name;
+	void (*fill16)(uint16_t *dst, uint16_t val, size_t n);
+	void (*fill32)(uint32_t *dst, uint32_t val, size_t n);
+};
+
+/* NULL until gfxprim_simd_init() finds a supported instruction set */
+static const struct span_kernels *kernels;
+
+#ifdef HAVE_SIMD_SSE2
+static void fill16_sse2(uint16_t *dst, uint16_t val, size_t n) {
+	__m128i v = _mm_set1_epi16((short)val);
+
+	for (; n && ((uintptr_t)dst & 15); n--)
+		*dst++ = val;
+
+	for (; n >= 32; n -= 32, dst += 32) {
+		_mm_store_si128((__m128i *)dst, v);
+		_mm_store_si128((__m128i *)(dst + 8), v);
+		_mm_store_si128((__m128i *)(dst + 16), v);
+		_mm_store_si128((__m128i *)(dst + 24), v);
+	}
+
+	for (; n >= 8; n -= 8, dst += 8)
+		_mm_store_si128((__m128i *)dst, v);
+
+	while (n--)
+		*dst++ = val;
+}
+
+static void fill32_sse2(uint32_t *dst, uint32_t val, size_t n) {
+	__m128i v = _mm_set1_epi32((int)val);
+
+	for (; n && ((uintptr_t)dst & 15); n--)
+		*dst++ = val;
+
+	for (; n >= 16; n -= 16, dst += 16) {
+		_mm_store_si128((__m128i *)dst, v);
+		_mm_store_si128((__m128i *)(dst + 4), v);
+		_mm_store_si128((__m128i *)(dst + 8), v);
+		_mm_store_si128((__m128i *)(dst + 12), v);
+	}
+
+	for (; n >= 4; n -= 4, dst += 4)
+		_mm_store_si128((__m128i *)dst, v);
+
+	while (n--)
+		*dst++ = val;
+}
+
+static const struct span_kernels kernels_sse2 = {
+	.name   = "SSE2",
+	.fill16 = fill16_sse2,
+	.fill32 = fill32_sse2,
+};
+#endif
+
+#ifdef HAVE_SIMD_AVX2
+__attribute__((target("avx2")))
+static void fill16_avx2(uint16_t *dst, uint16_t val, size_t n) {
+	__m256i v = _mm256_set1_epi16((short)val);
+
+	for (; n && ((uintptr_t)dst & 31); n--)
+		*dst++ = val;
+
+	for (; n >= 64; n -= 64, dst += 64) {
+		_mm256_store_si256((__m256i *)dst, v);
+		_mm256_store_si256((__m256i *)(dst + 16), v);
+		_mm256_store_si256((__m256i *)(dst + 32), v);
+		_mm256_store_si256((__m256i *)(dst + 48), v);
+	}
+
+	for (; n >= 16; n -= 16, dst += 16)
+		_mm256_store_si256((__m256i *)dst, v);
+
+	while (n--)
+		*dst++ = val;
+}
+
+__attribute__((target("avx2")))
+static void fill32_avx2(uint32_t *dst, uint32_t val, size_t n) {
+	__m256i v = _mm256_set1_epi32((int)val);
+
+	for (; n && ((uintptr_t)dst & 31); n--)
+		*dst++ = val;
+
+	for (; n >= 32; n -= 32, dst += 32) {
+		_mm256_store_si256((__m256i *)dst, v);
+		_mm256_store_si256((__m256i *)(dst + 8), v);
+		_mm256_store_si256((__m256i *)(dst + 16), v);
+		_mm256_store_si256((__m256i *)(dst + 24), v);
+	}
+
+	for (; n >= 8; n -= 8, dst += 8)
+		_mm256_store_si256((__m256i *)dst, v);
+
+	while (n--)
+		*dst++ = val;
+}
+
+static const struct span_kernels kernels_avx2 = {
+	.name   = "AVX2",
+	.fill16 = fill16_avx2,
+	.fill32 = fill32_avx2,
+};
+#endif
+
+#ifdef HAVE_SIMD_NEON
+static void fill16_neon(uint16_t *dst, uint16_t val, size_t n) {
+	uint16x8_t v = vdupq_n_u16(val);
+
+	for (; n >= 32; n -= 32, dst += 32) {
+		vst1q_u16(dst, v);
+		vst1q_u16(dst + 8, v);
+		vst1q_u16(dst + 16, v);
+		vst1q_u16(dst + 24, v);
+	}
+
+	for (; n >= 8; n -= 8, dst += 8)
+		vst1q_u16(dst, v);
+
+	while (n--)
+		*dst++ = val;
+}
+
+static void fill32_neon(uint32_t *dst, uint32_t val, size_t n) {
+	uint32x4_t v = vdupq_n_u32(val);
+
+	for (; n >= 16; n -= 16, dst += 16) {
+		vst1q_u32(dst, v);
+		vst1q_u32(dst + 4, v);
+		vst1q_u32(dst + 8, v);
+		vst1q_u32(dst + 12, v);
+	}
+
+	for (; n >= 4; n -= 4, dst += 4)
+		vst1q_u32(dst, v);
+
+	while (n--)
+		*dst++ = val;
+}
+
+static const struct span_kernels kernels_neon = {
+	.name   = "NEON",
+	.fill16 = fill16_neon,
+	.fill32 = fill32_neon,
+};
+#endif
+
+const char *gfxprim_simd_init(uint64_t cpu_features) {
+	/* Instruction sets the binary is built for are always there */
+#ifdef HAVE_SIMD_SSE2
+	cpu_features |= RETRO_SIMD_SSE2;
+#endif
+#ifdef HAVE_SIMD_NEON
+	cpu_features |= RETRO_SIMD_NEON;
+#endif
+
+	kernels = NULL;
+
+#ifdef HAVE_SIMD_AVX2
+	if (cpu_features & RETRO_SIMD_AVX2)
+		kernels = &kernels_avx2;
+#endif
+#ifdef HAVE_SIMD_SSE2
+	if (!kernels && (cpu_features & RETRO_SIMD_SSE2))
+		kernels = &kernels_sse2;
+#endif
+#ifdef HAVE_SIMD_NEON
+	if (!kernels && (cpu_features & RETRO_SIMD_NEON))
+		kernels = &kernels_neon;
+#endif
+
+	return kernels ? kernels->name : NULL;
+}
+
+static int simd_pixmap(const gp_pixmap *pixmap) {
+	if (!kernels || pixmap->axes_swap || pixmap->x_swap || pixmap->y_swap)
+		return 0;
+
+	switch (pixmap->pixel_type) {
+		case GP_PIXEL_RGB565:   return 2;
+		case GP_PIXEL_xRGB8888: return 4;
+		default:                return 0;
+	}
+}
+
+static void fill_span(gp_pixmap *pixmap, int bpp, gp_coord x, gp_coord y,
+                      size_t n, gp_pixel pixel) {
+	uint8_t *row = pixmap->pixels + (size_t)y * pixmap->bytes_per_row;
+
+	if (bpp == 2)
+		kernels->fill16((uint16_t *)row + x, (uint16_t)pixel, n);
+	else
+		kernels->fill32((uint32_t *)row + x, (uint32_t)pixel, n);
+}
+
+/* Fills the clipped, inclusive x0..x1 times y0..y1 rectangle */
+static void fill_rect(gp_pixmap *pixmap, int bpp, gp_coord x0, gp_coord y0,
+                      gp_coord x1, gp_coord y1, gp_pixel pixel) {
+	gp_coord tmp, y;
+
+	if (x0 > x1) {
+		tmp = x0; x0 = x1; x1 = tmp;
+	}
+	if (y0 > y1) {
+		tmp = y0; y0 = y1; y1 = tmp;
+	}
+
+	if (x0 < 0)
+		x0 = 0;
+	if (y0 < 0)
+		y0 = 0;
+	if (x1 >= (gp_coord)pixmap->w)
+		x1 = pixmap->w - 1;
+	if (y1 >= (gp_coord)pixmap->h)
+		y1 = pixmap->h - 1;
+
+	if (x0 > x1 || y0 > y1)
+		return;
+
+	for (y = y0; y <= y1; y++)
+		fill_span(pixmap, bpp, x0, y, x1 - x0 + 1, pixel);
+}
+
+void gfxprim_hline(gp_pixmap *pixmap, gp_coord x0, gp_coord x1, gp_coord y, gp_pixel pixel) {
+	int bpp = simd_pixmap(pixmap);
+
+	if (!bpp) {
+		gp_hline(pixmap, x0, x1, y, pixel);
+		return;
+	}
+
+	fill_rect(pixmap, bpp, x0, y, x1, y, pixel);
+}
+
+void gfxprim_fill(gp_pixmap *pixmap, gp_pixel pixel) {
+	int bpp = simd_pixmap(pixmap);
+	gp_coord y;
+
+	if (!bpp) {
+		gp_fill(pixmap, pixel);
+		return;
+	}
+
+	/* Contiguous rows are filled as a single span */
+	if (pixmap->bytes_per_row == pixmap->w * (uint32_t)bpp) {
+		fill_span(pixmap, bpp, 0, 0, (size_t)pixmap->w * pixmap->h, pixel);
+		return;
+	}
+
+	for (y = 0; y < (gp_coord)pixmap->h; y++)
+		fill_span(pixmap, bpp, 0, y, pixmap->w, pixel);
+}
+
+void gfxprim_fill_rect(gp_pixmap *pixmap, gp_coord x0, gp_coord y0,
+                       gp_coord x1, gp_coord y1, gp_pixel pixel) {
+	int bpp = simd_pixmap(pixmap);
+
+	if (!bpp) {
+		gp_fill_rect(pixmap, x0, y0, x1, y1, pixel);
+		return;
+	}
+
+	fill_rect(pixmap, bpp, x0, y0, x1, y1, pixel);
+}
+
+void gfxprim_fill_rect_xywh(gp_pixmap *pixmap, gp_coord x, gp_coord y,
+                            gp_size w, gp_size h, gp_pixel pixel) {
+	int bpp = simd_pixmap(pixmap);
+
+	if (!bpp) {
+		gp_fill_rect_xywh(pixmap, x, y, w, h, pixel);
+		return;
+	}
+
+	if (w == 0 || h == 0)
+		return;
+
+	fill_rect(pixmap, bpp, x, y, x + w - 1, y + h - 1, pixel);
+}
+
+/* Produces the same spans as gp_fill_circle() */
+void gfxprim_fill_circle(gp_pixmap *pixmap, gp_coord xcenter, gp_coord ycenter,
+                         gp_size r, gp_pixel pixel) {
+	int bpp = simd_pixmap(pixmap);
+	int x, y, error;
+
+	if (!bpp) {
+		gp_fill_circle(pixmap, xcenter, ycenter, r, pixel);
+		return;
+	}
+
+	if (r == 0) {
+		fill_rect(pixmap, bpp, xcenter, ycenter, xcenter, ycenter, pixel);
+		return;
+	}
+
+	for (x = 0, error = -(int)r, y = r; y >= 0; y--) {
+		while (error < 0) {
+			error += 2 * x + 1;
+			x++;
+		}
+		error += -2 * y + 1;
+
+		fill_rect(pixmap, bpp, xcenter - x + 1, ycenter - y, xcenter + x - 1, ycenter - y, pixel);
+		fill_rect(pixmap, bpp, xcenter - x + 1, ycenter + y, xcenter + x - 1, ycenter + y, pixel);
+	}
+}
+
+/*
+ * Same format blits are row copies, done with the libc memmove(), which is
+ * vectorized and dispatched by CPU in every libc we build against. memcpy()
+ * would not do, blits within one pixmap may overlap on the same row.
+ */
+void gfxprim_blit_xywh_clipped(const gp_pixmap *src, gp_coord x0, gp_coord y0,
+                               gp_size w0, gp_size h0, gp_pixmap *dst,
+                               gp_coord x1, gp_coord y1) {
+	int bpp = simd_pixmap(dst);
+	gp_coord w = w0, h = h0, y;
+
+	if (!bpp || src->pixel_type != dst->pixel_type ||
+	    src->axes_swap || src->x_swap || src->y_swap) {
+		gp_blit_xywh_clipped(src, x0, y0, w0, h0, dst, x1, y1);
+		return;
+	}
+
+	if (x0 < 0) {
+		w += x0; x1 -= x0; x0 = 0;
+	}
+	if (y0 < 0) {
+		h += y0; y1 -= y0; y0 = 0;
+	}
+	if (x1 < 0) {
+		w += x1; x0 -= x1; x1 = 0;
+	}
+	if (y1 < 0) {
+		h += y1; y0 -= y1; y1 = 0;
+	}
+
+	if (x0 + w > (gp_coord)src->w)
+		w = src->w - x0;
+	if (y0 + h > (gp_coord)src->h)
+		h = src->h - y0;
+	if (x1 + w > (gp_coord)dst->w)
+		w = dst->w - x1;
+	if (y1 + h > (gp_coord)dst->h)
+		h = dst->h - y1;
+
+	if (w <= 0 || h <= 0)
+		return;
+
+	/* Overlapping blits within one pixmap have to copy downwards bottom up */
+	int reverse = src == dst && y1 > y0;
+
+	for (y = 0; y < h; y++) {
+		gp_coord row = reverse ? h - 1 - y : y;
+		const uint8_t *s = src->pixels + (size_t)(y0 + row) * src->bytes_per_row + (size_t)x0 * bpp;
+		uint8_t *d = dst->pixels + (size_t)(y1 + row) * dst->bytes_per_row + (size_t)x1 * bpp;
+
+		memmove(d, s, (size_t)w * bpp);
+	}
+}
@@ -0,0 +1,39 @@
+#ifndef GFXPRIM_SIMD_H_
+#define GFXPRIM_SIMD_H_
+
+#include <stdint.h>
+
+#include "gfxprim.h"
+
+/*
+ * Vectorized fill and blit kernels for RGB565 and xRGB8888 pixmaps.
+ *
+ * Each function has the same semantics as its gfxprim counterpart. Pixmaps in
+ * other pixel types, rotated pixmaps and CPUs without SSE2, AVX2 or NEON fall
+ * back to the generic gfxprim code.
+ */
+
+/*
+ * Selects the kernels for the RETRO_SIMD_* cpu_features mask and returns the
+ * name of the instruction set in use, or NULL for the generic fallback.
+ */
+const char *gfxprim_simd_init(uint64_t cpu_features);
+
+void gfxprim_hline(gp_pixmap *pixmap, gp_coord x0, gp_coord x1, gp_coord y, gp_pixel pixel);
+
+void gfxprim_fill(gp_pixmap *pixmap, gp_pixel pixel);
+
+void gfxprim_fill_rect(gp_pixmap *pixmap, gp_coord x0, gp_coord y0,
+                       gp_coord x1, gp_coord y1, gp_pixel pixel);
+
+void gfxprim_fill_rect_xywh(gp_pixmap *pixmap, gp_coord x, gp_coord y,
+                            gp_size w, gp_size h, gp_pixel pixel);
+
+void gfxprim_fill_circle(gp_pixmap *pixmap, gp_coord xcenter, gp_coord ycenter,
+                         gp_size r, gp_pixel pixel);
+
+void gfxprim_blit_xywh_clipped(const gp_pixmap *src, gp_coord x0, gp_coord y0,
+                               gp_size w0, gp_size h0, gp_pixmap *dst,
+                               gp_coord x1, gp_coord y1);
+
+#endif  // GFXPRIM_SIMD_H_
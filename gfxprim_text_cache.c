@@ -0,0 +1,406 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gfxprim_simd.h"
+#include "gfxprim_text_cache.h"
+
+/* Number of hash table slots, must be a power of two. */
+#define TEXT_CACHE_SLOTS 1024
+/* Longest string, in bytes, that is cached as a whole line. */
+#define TEXT_CACHE_LINE_MAX 64
+/* Size of the table of recently seen lines, must be a power of two. */
+#define TEXT_CACHE_SEEN 256
+
+/* gp_text() alignment masks, any other flag bypasses the cache. */
+#define TEXT_ALIGN_HORIZ 0x0f
+#define TEXT_ALIGN_VERT  0x70
+
+/*
+ * Hashed and compared bytewise, so keys are zeroed and filled in field by
+ * field to keep the padding deterministic.
+ */
+struct text_cache_key {
+	const gp_font_face *font;
+	int pixel_xmul, pixel_ymul;
+	int pixel_xspace, pixel_yspace;
+	int char_xspace;
+	enum gp_pixel_type pixel_type;
+	gp_pixel fg, bg;
+	/* Unicode code point for glyphs, zero for lines */
+	uint32_t glyph;
+	/* String hash for lines, zero for glyphs */
+	uint32_t line;
+};
+
+struct text_cache_entry {
+	struct text_cache_key key;
+	uint32_t hash;
+	/* Copy of the string for lines */
+	char *str;
+	gp_coord x, y;
+	gp_size w, h;
+	/* Pen advance for glyphs, including the inter-character spacing */
+	gp_coord advance;
+	bool used;
+};
+
+struct gfxprim_text_cache {
+	gp_pixmap *atlas;
+	gp_size atlas_w, atlas_h;
+	gp_coord shelf_x, shelf_y;
+	gp_size shelf_h;
+	unsigned int entries_used;
+	uint32_t seen[TEXT_CACHE_SEEN];
+	struct text_cache_entry entries[TEXT_CACHE_SLOTS];
+};
+
+static uint32_t hash_bytes(uint32_t hash, const void *data, size_t len) {
+	const uint8_t *bytes = data;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= bytes[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static void key_init(struct text_cache_key *key, const gp_text_style *style,
+                     const gp_pixmap *pixmap, gp_pixel fg, gp_pixel bg) {
+	memset(key, 0, sizeof(*key));
+
+	key->font = style->font;
+	key->pixel_xmul = style->pixel_xmul;
+	key->pixel_ymul = style->pixel_ymul;
+	key->pixel_xspace = style->pixel_xspace;
+	key->pixel_yspace = style->pixel_yspace;
+	key->char_xspace = style->char_xspace;
+
+	key->pixel_type = pixmap->pixel_type;
+	key->fg = fg;
+	key->bg = bg;
+}
+
+static struct text_cache_entry *lookup(gfxprim_text_cache *self,
+                                       const struct text_cache_key *key,
+                                       uint32_t hash, const char *str) {
+	unsigned int i = hash & (TEXT_CACHE_SLOTS - 1);
+
+	for (;;) {
+		struct text_cache_entry *entry = &self->entries[i];
+
+		if (!entry->used)
+			return entry;
+
+		if (entry->hash == hash && !memcmp(&entry->key, key, sizeof(*key)) &&
+		    (!str || !strcmp(entry->str, str)))
+			return entry;
+
+		i = (i + 1) & (TEXT_CACHE_SLOTS - 1);
+	}
+}
+
+static struct text_cache_entry *find_free(gfxprim_text_cache *self, uint32_t hash) {
+	unsigned int i = hash & (TEXT_CACHE_SLOTS - 1);
+
+	while (self->entries[i].used)
+		i = (i + 1) & (TEXT_CACHE_SLOTS - 1);
+
+	return &self->entries[i];
+}
+
+void gfxprim_text_cache_flush(gfxprim_text_cache *self) {
+	unsigned int i;
+
+	if (!self)
+		return;
+
+	for (i = 0; i < TEXT_CACHE_SLOTS; i++) {
+		free(self->entries[i].str);
+		self->entries[i].str = NULL;
+		self->entries[i].used = false;
+	}
+
+	self->entries_used = 0;
+	self->shelf_x = 0;
+	self->shelf_y = 0;
+	self->shelf_h = 0;
+}
+
+/* Packs a w x h cell on the current shelf, the shelf is left as is on failure. */
+static bool atlas_reserve(gfxprim_text_cache *self, gp_size w, gp_size h,
+                          gp_coord *x, gp_coord *y) {
+	gp_coord shelf_x = self->shelf_x;
+	gp_coord shelf_y = self->shelf_y;
+	gp_size shelf_h = self->shelf_h;
+
+	if (shelf_x + w > self->atlas->w) {
+		shelf_x = 0;
+		shelf_y += shelf_h;
+		shelf_h = 0;
+	}
+
+	if (w > self->atlas->w || shelf_y + h > self->atlas->h)
+		return false;
+
+	*x = shelf_x;
+	*y = shelf_y;
+
+	self->shelf_x = shelf_x + w;
+	self->shelf_y = shelf_y;
+	self->shelf_h = h > shelf_h ? h : shelf_h;
+
+	return true;
+}
+
+/*
+ * Renders str into a w x h atlas cell and fills in a free entry. When the
+ * atlas or the table is full everything is flushed first, which invalidates
+ * any other entry pointers held by the caller. Cells that would not fit even
+ * an empty atlas fail without flushing.
+ */
+static struct text_cache_entry *insert(gfxprim_text_cache *self,
+                                       const struct text_cache_key *key,
+                                       uint32_t hash, const gp_text_style *style,
+                                       const char *str, gp_size w, gp_size h,
+                                       bool is_line) {
+	gp_coord x, y;
+
+	if (w > self->atlas->w || h > self->atlas->h)
+		return NULL;
+
+	if (self->entries_used >= TEXT_CACHE_SLOTS / 4 * 3 ||
+	    !atlas_reserve(self, w, h, &x, &y)) {
+		gfxprim_text_cache_flush(self);
+		if (!atlas_reserve(self, w, h, &x, &y))
+			return NULL;
+	}
+
+	struct text_cache_entry *entry = find_free(self, hash);
+
+	if (is_line) {
+		size_t len = strlen(str) + 1;
+
+		entry->str = malloc(len);
+		if (!entry->str)
+			return NULL;
+
+		memcpy(entry->str, str, len);
+	}
+
+	/* Copied with memcpy() so that the zeroed padding matches in lookup() */
+	memcpy(&entry->key, key, sizeof(*key));
+	entry->hash = hash;
+	entry->x = x;
+	entry->y = y;
+	entry->w = w;
+	entry->h = h;
+	entry->used = true;
+	self->entries_used++;
+
+	gfxprim_fill_rect_xywh(self->atlas, x, y, w, h, key->bg);
+	gp_text(self->atlas, style, x, y, GP_ALIGN_RIGHT | GP_VALIGN_BELOW,
+	        key->fg, key->bg, str);
+
+	return entry;
+}
+
+/* Scales the font advance the same way gp_text() scales glyph pixels. */
+static gp_coord glyph_advance(const gp_text_style *style, uint32_t glyph) {
+	const gp_glyph *g = gp_get_glyph(style->font, glyph);
+
+	if (!g)
+		return -1;
+
+	if (!g->advance_x)
+		return style->char_xspace;
+
+	return g->advance_x * style->pixel_xmul +
+	       (g->advance_x - 1) * style->pixel_xspace + style->char_xspace;
+}
+
+static struct text_cache_entry *get_glyph(gfxprim_text_cache *self,
+                                          struct text_cache_key *key,
+                                          const gp_text_style *style,
+                                          const char *str, size_t len,
+                                          uint32_t glyph) {
+	char buf[8];
+	gp_coord advance;
+
+	key->glyph = glyph;
+	key->line = 0;
+
+	uint32_t hash = hash_bytes(2166136261u, key, sizeof(*key));
+	struct text_cache_entry *entry = lookup(self, key, hash, NULL);
+
+	if (entry->used)
+		return entry;
+
+	if (len >= sizeof(buf))
+		return NULL;
+
+	advance = glyph_advance(style, glyph);
+	if (advance < 0)
+		return NULL;
+
+	memcpy(buf, str, len);
+	buf[len] = 0;
+
+	entry = insert(self, key, hash, style, buf, gp_text_width(style, buf),
+	               gp_text_height(style), false);
+	if (entry)
+		entry->advance = advance;
+
+	return entry;
+}
+
+static bool text_topleft(const gp_text_style *style, int align,
+                         gp_size w, gp_coord *x, gp_coord *y) {
+	switch (align & TEXT_ALIGN_HORIZ) {
+		case GP_ALIGN_LEFT:   *x = *x - w + 1; break;
+		case GP_ALIGN_CENTER: *x = *x - w / 2; break;
+		case GP_ALIGN_RIGHT:  break;
+		default: return false;
+	}
+
+	switch (align & TEXT_ALIGN_VERT) {
+		case GP_VALIGN_ABOVE:    *y = *y - gp_text_height(style) + 1; break;
+		case GP_VALIGN_CENTER:   *y = *y - gp_text_height(style) / 2; break;
+		case GP_VALIGN_BASELINE: *y = *y - gp_text_ascent(style) + 1; break;
+		case GP_VALIGN_BELOW:    break;
+		default: return false;
+	}
+
+	return true;
+}
+
+static bool draw_line(gfxprim_text_cache *self, gp_pixmap *pixmap,
+                      struct text_cache_key *key, const gp_text_style *style,
+                      gp_coord x, gp_coord y, int align, const char *str,
+                      size_t len, gp_size *width) {
+	key->glyph = 0;
+	key->line = hash_bytes(2166136261u, str, len) | 1;
+
+	uint32_t hash = hash_bytes(2166136261u, key, sizeof(*key));
+	struct text_cache_entry *entry = lookup(self, key, hash, str);
+
+	if (!entry->used) {
+		uint32_t *seen = &self->seen[hash & (TEXT_CACHE_SEEN - 1)];
+
+		/* Only strings drawn more than once are worth a whole line */
+		if (*seen != hash) {
+			*seen = hash;
+			return false;
+		}
+
+		gp_size w = gp_text_width(style, str);
+		gp_size h = gp_text_height(style);
+
+		/* Lines that don't fit the atlas are drawn glyph by glyph */
+		if (w > self->atlas->w || h > self->atlas->h)
+			return false;
+
+		entry = insert(self, key, hash, style, str, w, h, true);
+		if (!entry)
+			return false;
+	}
+
+	if (!text_topleft(style, align, entry->w, &x, &y))
+		return false;
+
+	gfxprim_blit_xywh_clipped(self->atlas, entry->x, entry->y, entry->w, entry->h, pixmap, x, y);
+	*width = entry->w;
+
+	return true;
+}
+
+/*
+ * Glyph cells are blitted at the pen position, which moves by the glyph
+ * advance just like in gp_text(). Cells are opaque, so a glyph overhanging
+ * its advance is partly covered by the background of the next one.
+ */
+static void draw_glyphs(gfxprim_text_cache *self, gp_pixmap *pixmap,
+                        struct text_cache_key *key, const gp_text_style *style,
+                        gp_coord x, gp_coord y, const char *str) {
+	struct text_cache_entry *entry;
+	const char *s, *prev;
+	gp_coord pen = x;
+	uint32_t glyph;
+
+	for (s = str, prev = s; (glyph = gp_utf8_next(&s)); prev = s) {
+		entry = get_glyph(self, key, style, prev, s - prev, glyph);
+		if (!entry) {
+			/* Redraws the glyphs blitted so far too, they are opaque */
+			gp_text(pixmap, style, x, y, GP_ALIGN_RIGHT | GP_VALIGN_BELOW, key->fg, key->bg, str);
+			return;
+		}
+
+		gfxprim_blit_xywh_clipped(self->atlas, entry->x, entry->y, entry->w, entry->h, pixmap, pen, y);
+		pen += entry->advance;
+	}
+}
+
+gp_size gfxprim_text_cache_draw(gfxprim_text_cache *self, gp_pixmap *pixmap,
+                                const gp_text_style *style, gp_coord x, gp_coord y,
+                                int align, gp_pixel fg, gp_pixel bg, const char *str) {
+	static const gp_text_style default_style = GP_DEFAULT_TEXT_STYLE;
+	struct text_cache_key key;
+	gp_size width;
+
+	if (!style)
+		style = &default_style;
+
+	if (!self || !str || !style->font || (align & ~(TEXT_ALIGN_HORIZ | TEXT_ALIGN_VERT)) ||
+	    pixmap->axes_swap || pixmap->x_swap || pixmap->y_swap)
+		return gp_text(pixmap, style, x, y, align, fg, bg, str);
+
+	if (self->atlas && self->atlas->pixel_type != pixmap->pixel_type) {
+		gfxprim_text_cache_flush(self);
+		gp_pixmap_free(self->atlas);
+		self->atlas = NULL;
+	}
+
+	if (!self->atlas) {
+		self->atlas = gp_pixmap_alloc(self->atlas_w, self->atlas_h, pixmap->pixel_type);
+		if (!self->atlas)
+			return gp_text(pixmap, style, x, y, align, fg, bg, str);
+	}
+
+	key_init(&key, style, pixmap, fg, bg);
+
+	size_t len = strlen(str);
+	if (len <= TEXT_CACHE_LINE_MAX &&
+	    draw_line(self, pixmap, &key, style, x, y, align, str, len, &width))
+		return width;
+
+	width = gp_text_width(style, str);
+	if (!text_topleft(style, align, width, &x, &y))
+		return gp_text(pixmap, style, x, y, align, fg, bg, str);
+
+	draw_glyphs(self, pixmap, &key, style, x, y, str);
+
+	return width;
+}
+
+gfxprim_text_cache *gfxprim_text_cache_alloc(gp_size atlas_w, gp_size atlas_h) {
+	gfxprim_text_cache *self = calloc(1, sizeof(*self));
+	if (!self)
+		return NULL;
+
+	self->atlas_w = atlas_w;
+	self->atlas_h = atlas_h;
+
+	return self;
+}
+
+void gfxprim_text_cache_free(gfxprim_text_cache *self) {
+	if (!self)
+		return;
+
+	gfxprim_text_cache_flush(self);
+	if (self->atlas)
+		gp_pixmap_free(self->atlas);
+	free(self);
+}
@@ -0,0 +1,37 @@
+#ifndef GFXPRIM_TEXT_CACHE_H_
+#define GFXPRIM_TEXT_CACHE_H_
+
+#include "gfxprim.h"
+
+/*
+ * Glyph atlas cache for gp_text().
+ *
+ * Glyphs are rasterized once per font, size, colors and pixel type into an
+ * atlas pixmap, so drawing text becomes a series of blits. Short strings that
+ * are drawn repeatedly are additionally cached as a whole line and drawn with
+ * a single blit.
+ *
+ * Cached glyphs are opaque: the glyph cell is filled with the bg color, which
+ * is also what gp_text() uses to blend anti-aliased glyphs. Use it for text on
+ * a solid background, which covers labels, logs and table cells.
+ */
+typedef struct gfxprim_text_cache gfxprim_text_cache;
+
+gfxprim_text_cache *gfxprim_text_cache_alloc(gp_size atlas_w, gp_size atlas_h);
+
+void gfxprim_text_cache_free(gfxprim_text_cache *self);
+
+/* Drops all cached glyphs and lines, e.g. after a font has been freed. */
+void gfxprim_text_cache_flush(gfxprim_text_cache *self);
+
+/*
+ * Draws str like gp_text() and returns the text width. Glyphs are laid out
+ * with the font advance as in gp_text(), but drawn as opaque cells, so glyphs
+ * overhanging into their neighbour are cut. Other flags than alignment and
+ * rotated pixmaps fall back to gp_text().
+ */
+gp_size gfxprim_text_cache_draw(gfxprim_text_cache *self, gp_pixmap *pixmap,
+                                const gp_text_style *style, gp_coord x, gp_coord y,
+                                int align, gp_pixel fg, gp_pixel bg, const char *str);
+
+#endif  // GFXPRIM_TEXT_CACHE_H_
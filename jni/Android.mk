@@ -5,10 +5,11 @@ SOURCE_DIR  := $(CORE_DIR)
 INCLUDES    :=
 SOURCES_C   :=
 SOURCES_CXX :=
+HAVE_THREADS := 1
 
 include $(CORE_DIR)/Makefile.common
 
-COREFLAGS := -DANDROID -D__LIBRETRO__ -DHAVE_STRINGS_H -DRIGHTSHIFT_IS_SAR $(INCFLAGS)
+COREFLAGS := -DANDROID -D__LIBRETRO__ -DHAVE_STRINGS_H -DRIGHTSHIFT_IS_SAR $(COREDEFINES) $(INCFLAGS)
 
 include $(CLEAR_VARS)
 LOCAL_MODULE    := retro
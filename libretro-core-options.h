@@ -60,6 +60,19 @@ struct retro_core_option_definition option_defs_us[] = {
 		},
 		"16 Bit"
 	},
+	{
+		"gfxprim_framerate",
+		"Frame Rate",
+		"Sets the target frame rate. Native follows the refresh rate of the display. Frames are skipped when rendering falls behind.",
+		{
+			{ "Native", NULL },
+			{ "30",     NULL },
+			{ "60",     NULL },
+			{ "120",    NULL },
+			{ NULL, NULL },
+		},
+		"60"
+	},
 	{ NULL, NULL, NULL, {{0}}, NULL },
 };
 